@@ -1,17 +1,103 @@
 #include <stdint.h>
 #include <string.h>  // For memset and memcpy
+#include <math.h>
 #include "VescUart.h"
 
+#if VESC_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define VESC_DWT_CTRL		(*(volatile uint32_t *)0xE0001000)
+#define VESC_DWT_CYCCNT		(*(volatile uint32_t *)0xE0001004)
+#define VESC_DWT_LAR		(*(volatile uint32_t *)0xE0001FB0)
+#define VESC_DEMCR			(*(volatile uint32_t *)0xE000EDFC)
+#endif
+
+static inline uint32_t profile_cycles(void) {
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+	return VESC_DWT_CYCCNT;
+#elif defined(__x86_64__) || defined(__i386__)
+	return (uint32_t)__rdtsc();
+#elif defined(F_CPU)
+	// No cycle counter (e.g. Cortex-M0, AVR), fall back to the microsecond timer
+	return micros() * (uint32_t)(F_CPU / 1000000UL);
+#else
+	return micros();
+#endif
+}
+
+// Adds the cycles between construction and destruction to one phase
+class profileScope {
+	public:
+		profileScope(VescUart::profilePackage & phase) : phase(phase), start(profile_cycles()) {}
+		~profileScope() {
+			uint32_t cycles = profile_cycles() - start;
+			phase.count++;
+			phase.total += cycles;
+			if (cycles > phase.max)
+				phase.max = cycles;
+		}
+	private:
+		VescUart::profilePackage & phase;
+		uint32_t start;
+};
+
+#define VESC_PROFILE_SCOPE(id)	profileScope profileScope_(profile[id])
+#else
+#define VESC_PROFILE_SCOPE(id)
+#endif
+
 VescUart::VescUart(uint32_t timeout_ms) : _TIMEOUT(timeout_ms) {
 	nunchuck.valueX         = 127;
 	nunchuck.valueY         = 127;
 	nunchuck.lowerButton  	= false;
 	nunchuck.upperButton  	= false;
+#if VESC_PREDICTOR_NODES > 0
+	memset(predictors, 0, sizeof(predictors));
+#endif
+	memset(subscribers, 0, sizeof(subscribers));
+#if VESC_RTT_ENTRIES > 0
+	memset(rttTable, 0, sizeof(rttTable));
+#endif
+	resetStats();
+#if VESC_PROFILE
+	resetProfile();
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+	VESC_DEMCR |= (1UL << 24);		// TRCENA
+	VESC_DWT_LAR = 0xC5ACCE55;		// Unlock, needed on Cortex-M7
+	VESC_DWT_CTRL |= 1UL;			// CYCCNTENA
+#endif
+#endif
+#if VESC_TX_BUFFER_SIZE > 0
+	txHead = 0;
+	txTail = 0;
+	txFrameLeft = 0;
+	txQueueUsable = false;
+	txDropped = 0;
+	txMerged = 0;
+	txHighWater = 0;
+#endif
+#if VESC_TRACE_SIZE > 0
+	traceHead = 0;
+	traceTail = 0;
+	traceDropped = 0;
+#endif
 }
 
 void VescUart::setSerialPort(Stream* port)
 {
 	serialPort = port;
+
+#if VESC_TX_BUFFER_SIZE > 0
+	// Frames queued for the previous port are dropped. An idle port without availableForWrite()
+	// support reports 0 (Print's default), it would never drain the queue.
+	txHead = 0;
+	txTail = 0;
+	txFrameLeft = 0;
+	txQueueUsable = (port != NULL && port->availableForWrite() > 0);
+#endif
 }
 
 void VescUart::setDebugPort(Stream* port)
@@ -19,6 +105,157 @@ void VescUart::setDebugPort(Stream* port)
 	debugPort = port;
 }
 
+void VescUart::resetStats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+#if VESC_PROFILE
+void VescUart::resetProfile(void)
+{
+	memset(profile, 0, sizeof(profile));
+}
+#endif
+
+void VescUart::setTimeSource(unsigned long (*source)(void), unsigned long (*microsTimeSource)(void))
+{
+	timeSource = (source != NULL ? source : millis);
+	microsSource = (microsTimeSource != NULL ? microsTimeSource : micros);
+}
+
+#if VESC_LARGE_FRAME_ARENA > 0
+static_assert(VESC_LARGE_FRAME_SLOTS >= 1 && VESC_LARGE_FRAME_SLOTS <= 8, "VESC_LARGE_FRAME_SLOTS must be 1 to 8");
+static_assert(VESC_LARGE_FRAME_SLOT_SIZE <= 65535, "Large frame slots are indexed with 16 bits");
+
+// One arena for all instances, split in equally sized slots
+static uint8_t large_frame_arena[VESC_LARGE_FRAME_SLOTS][VESC_LARGE_FRAME_SLOT_SIZE];
+static uint8_t large_frame_used = 0; // Bit per slot
+
+VescUart::arenaPackage VescUart::arena = { 0, 0, 0, 0, 0 };
+
+int8_t VescUart::borrowLargeFrame(uint32_t length)
+{
+	// One byte more for the terminating zero
+	if (length + 1 > VESC_LARGE_FRAME_SLOT_SIZE) {
+		arena.failures++;
+		return -1;
+	}
+
+	for (uint8_t i = 0; i < VESC_LARGE_FRAME_SLOTS; i++) {
+		if (!(large_frame_used & (1 << i))) {
+			large_frame_used |= (1 << i);
+			arena.borrows++;
+			arena.inUse++;
+			if (arena.inUse > arena.peakInUse)
+				arena.peakInUse = arena.inUse;
+			if (length > arena.peakLength)
+				arena.peakLength = length;
+			return i;
+		}
+	}
+
+	arena.failures++;
+	return -1;
+}
+
+void VescUart::releaseLargeFrame(int8_t slot)
+{
+	if (slot >= 0 && (large_frame_used & (1 << slot))) {
+		large_frame_used &= ~(1 << slot);
+		arena.inUse--;
+	}
+}
+
+uint8_t * VescUart::largeFrameSlot(int8_t slot)
+{
+	return large_frame_arena[slot];
+}
+
+void VescUart::processLargeFrame(uint8_t * frame, uint16_t lenPayload)
+{
+	uint16_t crcMessage = ((uint16_t)frame[lenPayload + 3] << 8) | frame[lenPayload + 4];
+	uint16_t crcPayload;
+	{
+		VESC_PROFILE_SCOPE(VESC_PHASE_CRC);
+		crcPayload = crc16(frame + 3, lenPayload);
+	}
+
+	if (crcPayload != crcMessage || lenPayload == 0) {
+		stats.crcErrors++;
+		trace(VESC_TRACE_CRC_ERROR, NULL, 0);
+		return;
+	}
+
+	// Validated in place, subscribers read it without a copy
+	stats.framesReceived++;
+	trace(VESC_TRACE_RX, frame + 3, lenPayload);
+	largePayload = frame + 3;
+	largePayloadLength = lenPayload;
+	notifySubscribers(largePayload[0], requestCanId);
+	largePayload = NULL;
+	largePayloadLength = 0;
+}
+#else
+void VescUart::releaseLargeFrame(int8_t slot)
+{
+	(void)slot;
+}
+#endif
+
+#if VESC_RTT_ENTRIES > 0
+void VescUart::setAdaptiveTimeout(uint32_t floor_ms, uint32_t ceiling_ms)
+{
+	timeoutFloor = floor_ms;
+	timeoutCeiling = (ceiling_ms >= floor_ms ? ceiling_ms : floor_ms);
+}
+
+VescUart::rttEntry * VescUart::findRtt(uint8_t packetId, uint8_t canId, bool create)
+{
+	for (uint8_t i = 0; i < VESC_RTT_ENTRIES; i++) {
+		if (rttTable[i].valid && rttTable[i].packetId == packetId && rttTable[i].canId == canId) {
+			return &rttTable[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	rttEntry * entry = &rttTable[rttNext];
+	rttNext = (rttNext + 1) % VESC_RTT_ENTRIES;
+	memset(entry, 0, sizeof(rttEntry));
+	entry->packetId = packetId;
+	entry->canId = canId;
+	return entry;
+}
+#endif
+
+uint32_t VescUart::getTimeout(uint8_t packetId, uint8_t canId)
+{
+#if VESC_RTT_ENTRIES > 0
+	if (timeoutCeiling == 0) {
+		return _TIMEOUT;
+	}
+
+	rttEntry * entry = findRtt(packetId, canId, false);
+	if (entry == NULL) {
+		return timeoutCeiling;
+	}
+
+	uint32_t timeout = (entry->srtt + 4 * entry->rttvar + 999) / 1000;
+
+	// RFC 6298: the backoff doubles the clamped RTO
+	if (timeout < timeoutFloor)
+		timeout = timeoutFloor;
+	timeout <<= entry->backoff;
+	if (timeout > timeoutCeiling)
+		timeout = timeoutCeiling;
+	return timeout;
+#else
+	(void)packetId; (void)canId;
+	return _TIMEOUT;
+#endif
+}
+
 // SAFE receiveUartMessage function with extended buffer checks
 int VescUart::receiveUartMessage(uint8_t * payloadReceived) {
 
@@ -34,86 +271,223 @@ int VescUart::receiveUartMessage(uint8_t * payloadReceived) {
 	bool messageRead = false;
 	uint8_t messageReceived[256];
 	uint16_t lenPayload = 0;
+
+	// Frames starting with 3 are stored in a slot borrowed from the shared arena
+	uint8_t * frame = messageReceived;
+	uint16_t frameSize = sizeof(messageReceived);
+	int8_t slot = -1;
+	uint32_t skipBytes = 0;
 	
 	// Initialize buffer with zeros
 	memset(messageReceived, 0, sizeof(messageReceived));
 	
-	uint32_t timeout = millis() + _TIMEOUT; // Defining the timestamp for timeout (100ms before timeout)
+	// Elapsed time is computed with unsigned subtraction so the timeout keeps working when millis() wraps after ~49.7 days
+	uint32_t start = timeSource();
+	uint32_t timeoutMs = getTimeout(requestPacketId, requestCanId);
 
-	while ( millis() < timeout && messageRead == false) {
+	while ( (uint32_t)(timeSource() - start) < timeoutMs && messageRead == false) {
+
+#if VESC_TX_BUFFER_SIZE > 0
+		// The request may still be queued behind earlier frames
+		processTx();
+#endif
 
 		while (serialPort->available()) {
+			VESC_PROFILE_SCOPE(VESC_PHASE_PARSE);
+
+			// Rest of a large frame that could not be stored
+			if (skipBytes > 0) {
+				serialPort->read();
+				skipBytes--;
+				stats.bytesDiscarded++;
+				continue;
+			}
 
-			// CRITICAL BOUNDARY-CHECK: Prevent buffer overflow!
-			if (counter >= sizeof(messageReceived) - 1) {
+			// CRITICAL BOUNDARY-CHECK: Prevent buffer overflow, drop the frame and resync
+			if (counter >= frameSize - 1) {
 				if (debugPort != NULL) {
 					debugPort->println("ERROR: Buffer overflow prevented!");
 				}
-				return -1; // Abort on buffer overflow risk
+				stats.framingErrors++;
+				stats.bytesDiscarded += counter;
+				trace(VESC_TRACE_FRAMING_ERROR, NULL, 0);
+				counter = 0;
+				endMessage = 256;
+				releaseLargeFrame(slot);
+				slot = -1;
+				frame = messageReceived;
+				frameSize = sizeof(messageReceived);
 			}
 
-			messageReceived[counter++] = serialPort->read();
-
-			if (counter == 2) {
-
-				switch (messageReceived[0])
-				{
-					case 2:
-						endMessage = messageReceived[1] + 5; //Payload size + 2 for sice + 3 for SRC and End.
-						lenPayload = messageReceived[1];
-						
-						// SAFETY CHECK: Validate endMessage
-						if (endMessage > sizeof(messageReceived) - 1) {
-							if (debugPort != NULL) {
-								debugPort->println("ERROR: Message too long, aborting!");
-							}
-							return -1;
-						}
-					break;
-
-					case 3:
-						// ToDo: Add Message Handling > 255 (starting with 3)
-						if( debugPort != NULL ){
-							debugPort->println("Message is larger than 256 bytes - not supported");
-						}
-						return -1; // Safe abort
-					break;
-
-					default:
-						if( debugPort != NULL ){
-							debugPort->println("Invalid start bit");
-						}
-						return -1; // Safe abort on invalid start
-					break;
+			frame[counter++] = serialPort->read();
+
+			// Resync: skip noise until a valid start byte instead of aborting the transaction
+			if (counter == 1) {
+				bool validStart = (frame[0] == 2);
+#if VESC_LARGE_FRAME_ARENA > 0
+				validStart = validStart || (frame[0] == 3); // Frames > 255 bytes are only accepted with an arena
+#endif
+				if (!validStart) {
+					if( debugPort != NULL ){
+						debugPort->println("Invalid start bit");
+					}
+					stats.bytesDiscarded++;
+					counter = 0;
+					continue;
 				}
 			}
 
-			// DOUBLE BOUNDARY-CHECKS for maximum safety
-			if (counter >= sizeof(messageReceived) - 1) {
-				if (debugPort != NULL) {
-					debugPort->println("ERROR: Buffer boundary reached!");
+			if (counter == 2 && messageReceived[0] == 2) {
+				endMessage = messageReceived[1] + 5; //Payload size + 2 for sice + 3 for SRC and End.
+				lenPayload = messageReceived[1];
+
+				// SAFETY CHECK: Validate endMessage, a length that does not fit is noise as well
+				if (endMessage > sizeof(messageReceived) - 1) {
+					if (debugPort != NULL) {
+						debugPort->println("ERROR: Message too long, dropping!");
+					}
+					stats.framingErrors++;
+					stats.bytesDiscarded += counter;
+					trace(VESC_TRACE_FRAMING_ERROR, NULL, 0);
+					counter = 0;
+					endMessage = 256;
+					continue;
 				}
-				break;
 			}
 
-			if (counter == endMessage && messageReceived[endMessage - 1] == 3) {
-				messageReceived[endMessage] = 0;
+#if VESC_LARGE_FRAME_ARENA > 0
+			if (counter == 3 && frame == messageReceived && messageReceived[0] == 3) {
+				uint32_t frameLength = (((uint16_t)messageReceived[1] << 8) | messageReceived[2]) + 6;
+
+				// A length no slot can hold is noise, skipping by it would swallow good frames
+				if (frameLength + 1 > VESC_LARGE_FRAME_SLOT_SIZE) {
+					if (debugPort != NULL) {
+						debugPort->println("ERROR: Message too long, dropping!");
+					}
+					arena.failures++;
+					stats.framingErrors++;
+					stats.bytesDiscarded += counter;
+					trace(VESC_TRACE_FRAMING_ERROR, NULL, 0);
+					counter = 0;
+					endMessage = 256;
+					continue;
+				}
+
+				slot = borrowLargeFrame(frameLength);
+				if (slot < 0) {
+					if( debugPort != NULL ){
+						debugPort->println("No large frame buffer available");
+					}
+					// All slots are busy, skip the frame to stay in sync with the stream
+					skipBytes = frameLength - 3;
+					stats.bytesDiscarded += 3;
+					counter = 0;
+					continue;
+				}
+
+				lenPayload = frameLength - 6;
+				endMessage = frameLength;
+				frame = largeFrameSlot(slot);
+				frameSize = VESC_LARGE_FRAME_SLOT_SIZE;
+				memcpy(frame, messageReceived, 3);
+			}
+#endif
+
+#if VESC_LARGE_FRAME_ARENA > 0
+			// Large frames are not the reply the caller waits for, hand them over and keep reading
+			if (counter == endMessage && slot >= 0 && frame[endMessage - 1] == 3) {
+				processLargeFrame(frame, lenPayload);
+				releaseLargeFrame(slot);
+				slot = -1;
+				frame = messageReceived;
+				frameSize = sizeof(messageReceived);
+				counter = 0;
+				endMessage = 256;
+				continue;
+			}
+#endif
+
+			if (counter == endMessage && frame[endMessage - 1] == 3) {
+				frame[endMessage] = 0;
 				if (debugPort != NULL) {
 					debugPort->println("End of message reached!");
 				}
 				messageRead = true;
 				break; // Exit if end of message is reached, even if there is still more data in the buffer.
 			}
+
+			// Wrong end byte: the frame was corrupted, drop it and look for the next start byte
+			if (counter == endMessage) {
+				if (debugPort != NULL) {
+					debugPort->println("Invalid end bit");
+				}
+				stats.framingErrors++;
+				stats.bytesDiscarded += counter;
+				trace(VESC_TRACE_FRAMING_ERROR, NULL, counter - 5);
+				counter = 0;
+				endMessage = 256;
+				releaseLargeFrame(slot);
+				slot = -1;
+				frame = messageReceived;
+				frameSize = sizeof(messageReceived);
+				continue;
+			}
+
+			// DOUBLE BOUNDARY-CHECKS for maximum safety, after the end checks so a frame that
+			// fills the buffer exactly is still delivered
+			if (counter >= frameSize - 1) {
+				if (debugPort != NULL) {
+					debugPort->println("ERROR: Buffer boundary reached!");
+				}
+				break;
+			}
 		}
 	}
-	if(messageRead == false && debugPort != NULL ) {
-		debugPort->println("Timeout");
+	if(messageRead == false) {
+		releaseLargeFrame(slot);
+		stats.timeouts++;
+		trace(VESC_TRACE_TIMEOUT, NULL, 0);
+#if VESC_RTT_ENTRIES > 0
+		if (timeoutCeiling != 0) {
+			rttEntry * entry = findRtt(requestPacketId, requestCanId, false);
+			if (entry != NULL && entry->backoff < 4)
+				entry->backoff++;
+		}
+#endif
+		if (debugPort != NULL) {
+			debugPort->println("Timeout");
+		}
 	}
 	
 	bool unpacked = false;
 
 	if (messageRead) {
 		unpacked = unpackPayload(messageReceived, endMessage, payloadReceived);
+		if (unpacked) {
+			stats.framesReceived++;
+			trace(VESC_TRACE_RX, payloadReceived, lenPayload);
+
+#if VESC_RTT_ENTRIES > 0
+			// RFC 6298 estimator: SRTT += err / 8, RTTVAR += (|err| - RTTVAR) / 4
+			if (timeoutCeiling != 0) {
+				int32_t sample = (int32_t)(microsSource() - requestMicros);
+				rttEntry * entry = findRtt(requestPacketId, requestCanId, true);
+				if (!entry->valid) {
+					entry->srtt = sample;
+					entry->rttvar = sample / 2;
+					entry->valid = 1;
+				} else {
+					int32_t err = sample - (int32_t)entry->srtt;
+					entry->srtt += err / 8;
+					entry->rttvar += ((err < 0 ? -err : err) - (int32_t)entry->rttvar) / 4;
+				}
+				entry->backoff = 0;
+			}
+#endif
+		} else {
+			stats.crcErrors++;
+			trace(VESC_TRACE_CRC_ERROR, NULL, lenPayload);
+		}
 	}
 
 	if (unpacked) {
@@ -142,9 +516,15 @@ bool VescUart::unpackPayload(uint8_t * message, int lenMes, uint8_t * payload) {
 	}
 
 	// Extract payload:
-	memcpy(payload, &message[2], message[1]);
+	{
+		VESC_PROFILE_SCOPE(VESC_PHASE_COPY);
+		memcpy(payload, &message[2], message[1]);
+	}
 
-	crcPayload = crc16(payload, message[1]);
+	{
+		VESC_PROFILE_SCOPE(VESC_PHASE_CRC);
+		crcPayload = crc16(payload, message[1]);
+	}
 
 	if( debugPort != NULL ){
 		debugPort->print("SRC calc: "); debugPort->println(crcPayload);
@@ -166,11 +546,13 @@ bool VescUart::unpackPayload(uint8_t * message, int lenMes, uint8_t * payload) {
 }
 
 
-// FIXED packSendPayload function with buffer overflow protection
-int VescUart::packSendPayload(uint8_t * payload, int lenPay) {
+// Frames the payload (start byte, length, CRC, end byte) into messageSend
+int VescUart::packPayload(uint8_t * payload, int lenPay, uint8_t * messageSend, int lenMessage) {
+
+	VESC_PROFILE_SCOPE(VESC_PHASE_ENCODE);
 
 	// SAFETY CHECKS: Prevent buffer overflow
-	if (!payload || lenPay <= 0) {
+	if (!payload || !messageSend || lenPay <= 0) {
 		return 0; // Safe return on invalid parameters
 	}
 	
@@ -179,28 +561,34 @@ int VescUart::packSendPayload(uint8_t * payload, int lenPay) {
 		return 0; // Payload too large - discard!
 	}
 
-	uint16_t crcPayload = crc16(payload, lenPay);
+	uint16_t crcPayload;
 	int count = 0;
-	uint8_t messageSend[256]; // Fixed size
-	
-	// Initialize buffer with zeros
-	memset(messageSend, 0, sizeof(messageSend));
+
+	{
+		VESC_PROFILE_SCOPE(VESC_PHASE_CRC);
+		crcPayload = crc16(payload, lenPay);
+	}
 	
 	if (lenPay <= 256)
 	{
+		if (lenMessage < 2) return 0;
 		messageSend[count++] = 2;
 		messageSend[count++] = lenPay;
 	}
 	else
 	{
+		if (lenMessage < 3) return 0;
 		messageSend[count++] = 3;
 		messageSend[count++] = (uint8_t)(lenPay >> 8);
 		messageSend[count++] = (uint8_t)(lenPay & 0xFF);
 	}
 
 	// SAFE payload copy with boundary check
-	if (count + lenPay + 3 <= sizeof(messageSend)) {
-		memcpy(messageSend + count, payload, lenPay);
+	if (count + lenPay + 3 <= lenMessage) {
+		{
+			VESC_PROFILE_SCOPE(VESC_PHASE_COPY);
+			memcpy(messageSend + count, payload, lenPay);
+		}
 		count += lenPay;
 
 		messageSend[count++] = (uint8_t)(crcPayload >> 8);
@@ -210,36 +598,217 @@ int VescUart::packSendPayload(uint8_t * payload, int lenPay) {
 		// Buffer would overflow - abort!
 		return 0;
 	}
+
+	return count;
+}
+
+// FIXED packSendPayload function with buffer overflow protection
+int VescUart::packSendPayload(uint8_t * payload, int lenPay) {
+
+	uint8_t messageSend[256]; // Fixed size
+	int count = packPayload(payload, lenPay, messageSend, sizeof(messageSend));
+
+	if (count == 0) {
+		return 0;
+	}
 	
 	if(debugPort!=NULL){
 		debugPort->print("Package to send: "); serialPrint(messageSend, count);
 	}
 
+	// Remember the request so its reply can be timed
+	requestCanId = 0;
+	requestPacketId = payload[0];
+	if (payload[0] == COMM_FORWARD_CAN && lenPay > 2) {
+		requestCanId = payload[1];
+		requestPacketId = payload[2];
+	}
+#if VESC_RTT_ENTRIES > 0
+	requestMicros = microsSource();
+#endif
+
 	// Sending package
-	if( serialPort != NULL )
-		serialPort->write(messageSend, count);
+	writeFrames(messageSend, count);
+
+	trace(VESC_TRACE_TX, payload, lenPay);
 
 	// Returns number of send bytes
 	return count;
 }
 
 
-bool VescUart::processReadPacket(uint8_t * message) {
+void VescUart::writeFrames(uint8_t * frames, int length) {
+
+	if (serialPort == NULL || length <= 0)
+		return;
+
+#if VESC_TX_BUFFER_SIZE > 0
+	// Fast path: nothing queued and the UART can take it all without blocking,
+	// or the port cannot tell and blocking writes are the only option
+	if (!txQueueUsable || (txHead == txTail && serialPort->availableForWrite() >= length)) {
+		VESC_PROFILE_SCOPE(VESC_PHASE_WRITE);
+		serialPort->write(frames, length);
+		return;
+	}
+
+	// Frames from packPayload() always start with 2 and a one byte length
+	int offset = 0;
+	while (offset + 1 < length) {
+		uint16_t frameLen = frames[offset + 1] + 5;
+		enqueueFrame(frames + offset, frameLen);
+		offset += frameLen;
+	}
+	processTx();
+#else
+	VESC_PROFILE_SCOPE(VESC_PHASE_WRITE);
+	serialPort->write(frames, length);
+#endif
+}
+
+#if VESC_TX_BUFFER_SIZE > 0
+static_assert((VESC_TX_BUFFER_SIZE & (VESC_TX_BUFFER_SIZE - 1)) == 0 && VESC_TX_BUFFER_SIZE <= 32768,
+	"VESC_TX_BUFFER_SIZE must be a power of two up to 32768");
+
+#define TX_AT(i)	txBuffer[(uint16_t)(i) & (VESC_TX_BUFFER_SIZE - 1)]
+
+// Messages where only the newest one per node and class matters, 0 if every message counts.
+// Duty, current, brake current and RPM all select the control mode, so they supersede each other.
+static uint8_t tx_merge_class(uint8_t packetId) {
+	switch (packetId) {
+		case COMM_SET_DUTY:
+		case COMM_SET_CURRENT:
+		case COMM_SET_CURRENT_BRAKE:
+		case COMM_SET_RPM:
+			return 1;
+		case COMM_SET_CHUCK_DATA:
+			return 2;
+		case COMM_ALIVE:
+			return 3;
+		default:
+			return 0;
+	}
+}
+
+void VescUart::enqueueFrame(const uint8_t * frame, uint16_t len) {
+
+	uint8_t canId = (frame[2] == COMM_FORWARD_CAN ? frame[3] : 0);
+	uint8_t packetId = (frame[2] == COMM_FORWARD_CAN ? frame[4] : frame[2]);
+	uint8_t mergeClass = tx_merge_class(packetId);
+
+	if (mergeClass != 0) {
+		// The frame being written right now cannot be touched anymore
+		uint16_t pos = txTail + txFrameLeft;
+		uint16_t last = txHead;	// Newest queued frame of the same class and node
+
+		while (pos != txHead) {
+			uint8_t queuedCanId = (TX_AT(pos + 2) == COMM_FORWARD_CAN ? TX_AT(pos + 3) : 0);
+			uint8_t queuedPacketId = (TX_AT(pos + 2) == COMM_FORWARD_CAN ? TX_AT(pos + 4) : TX_AT(pos + 2));
+
+			if (queuedCanId == canId && tx_merge_class(queuedPacketId) == mergeClass)
+				last = pos;
+			pos += TX_AT(pos + 1) + 5;
+		}
+
+		if (last != txHead) {
+			uint16_t queuedLen = TX_AT(last + 1) + 5;
+			uint8_t queuedPacketId = (TX_AT(last + 2) == COMM_FORWARD_CAN ? TX_AT(last + 4) : TX_AT(last + 2));
+			txMerged++;
+
+			// Nothing of this class follows it, so it can be updated in place
+			if (queuedLen == len && queuedPacketId == packetId) {
+				for (uint16_t i = 0; i < len; i++) {
+					TX_AT(last + i) = frame[i];
+				}
+				return;
+			}
+
+			// Another kind of setpoint, drop the old one and queue the new one behind the rest
+			for (uint16_t i = last + queuedLen; i != txHead; i++) {
+				TX_AT(i - queuedLen) = TX_AT(i);
+			}
+			txHead -= queuedLen;
+		}
+	}
+
+	if (VESC_TX_BUFFER_SIZE - (uint16_t)(txHead - txTail) < len) {
+		txDropped++;
+		return;
+	}
+
+	for (uint16_t i = 0; i < len; i++) {
+		TX_AT(txHead + i) = frame[i];
+	}
+	txHead += len;
+
+	if (txQueueDepth() > txHighWater)
+		txHighWater = txQueueDepth();
+}
+
+void VescUart::processTx(void) {
+
+	if (serialPort == NULL)
+		return;
+
+	while (txHead != txTail) {
+		int room = serialPort->availableForWrite();
+		if (room <= 0)
+			break;
+
+		if (txFrameLeft == 0)
+			txFrameLeft = TX_AT(txTail + 1) + 5;
+
+		// Write at most the rest of the current frame, and not across the end of the ring
+		uint16_t chunk = txFrameLeft;
+		uint16_t contiguous = VESC_TX_BUFFER_SIZE - (txTail & (VESC_TX_BUFFER_SIZE - 1));
+		if (chunk > contiguous)
+			chunk = contiguous;
+		if (chunk > room)
+			chunk = room;
+
+		{
+			VESC_PROFILE_SCOPE(VESC_PHASE_WRITE);
+			serialPort->write(&TX_AT(txTail), chunk);
+		}
+		txTail += chunk;
+		txFrameLeft -= chunk;
+	}
+}
+
+uint16_t VescUart::txQueueDepth(void) {
+	return txHead - txTail;
+}
+#endif
+
+bool VescUart::processReadPacket(uint8_t * message, int lenMes) {
+
+	VESC_PROFILE_SCOPE(VESC_PHASE_DECODE);
 
 	COMM_PACKET_ID packetId;
 	int32_t index = 0;
 
+	// SAFETY CHECK: Never decode past the received payload
+	if (message == NULL || lenMes < 1)
+		return false;
+
 	packetId = (COMM_PACKET_ID)message[0];
 	message++; // Removes the packetId from the actual message (payload)
+	lenMes--;
 
 	switch (packetId){
 		case COMM_FW_VERSION: // Structure defined here: https://github.com/vedderb/bldc/blob/43c3bbaf91f5052a35b75c2ff17b5fe99fad94d1/commands.c#L164
 
+			if (lenMes < 2)
+				return false;
+
 			fw_version.major = message[index++];
 			fw_version.minor = message[index++];
 			return true;
 		case COMM_GET_VALUES: // Structure defined here: https://github.com/vedderb/bldc/blob/43c3bbaf91f5052a35b75c2ff17b5fe99fad94d1/commands.c#L164
 
+			// Up to and including the fault code, pidPos and id are only decoded if present
+			if (lenMes < 53)
+				return false;
+
 			data.tempMosfet 		= buffer_get_float16(message, 10.0, &index); 	// 2 bytes - mc_interface_temp_fet_filtered()
 			data.tempMotor 			= buffer_get_float16(message, 10.0, &index); 	// 2 bytes - mc_interface_temp_motor_filtered()
 			data.avgMotorCurrent 	= buffer_get_float32(message, 100.0, &index); // 4 bytes - mc_interface_read_reset_avg_motor_current()
@@ -256,16 +825,46 @@ bool VescUart::processReadPacket(uint8_t * message) {
 			data.tachometer 		= buffer_get_int32(message, &index);				// 4 bytes - mc_interface_get_tachometer_value(false)
 			data.tachometerAbs 		= buffer_get_int32(message, &index);				// 4 bytes - mc_interface_get_tachometer_abs_value(false)
 			data.error 				= (mc_fault_code)message[index++];								// 1 byte  - mc_interface_get_fault()
-			data.pidPos				= buffer_get_float32(message, 1000000.0, &index);	// 4 bytes - mc_interface_get_pid_pos_now()
-			data.id					= message[index++];								// 1 byte  - app_get_configuration()->controller_id	
+			data.pidPos				= buffer_get_float32_safe(message, 1000000.0, &index, lenMes);	// 4 bytes - mc_interface_get_pid_pos_now()
+			data.id					= (index < lenMes ? message[index++] : 0);			// 1 byte  - app_get_configuration()->controller_id	
 
 			return true;
 
 		break;
 
-		/* case COMM_GET_VALUES_SELECTIVE:
+		case COMM_GET_VALUES_SELECTIVE: { // Same fields as COMM_GET_VALUES, only those set in the echoed mask are present
+
+			if (lenMes < 4)
+				return false;
+
+			uint32_t mask = buffer_get_uint32(message, &index);
+
+			// Check the length once, then decode without per-field bounds checks
+			if (lenMes < 4 + selectiveValuesLength(mask))
+				return false;
+
+			if (mask & VESC_VALUE_TEMP_MOSFET) 		data.tempMosfet 		= buffer_get_float16(message, 10.0, &index);
+			if (mask & VESC_VALUE_TEMP_MOTOR) 		data.tempMotor 			= buffer_get_float16(message, 10.0, &index);
+			if (mask & VESC_VALUE_MOTOR_CURRENT) 	data.avgMotorCurrent 	= buffer_get_float32(message, 100.0, &index);
+			if (mask & VESC_VALUE_INPUT_CURRENT) 	data.avgInputCurrent 	= buffer_get_float32(message, 100.0, &index);
+			if (mask & VESC_VALUE_ID) 				index += 4;
+			if (mask & VESC_VALUE_IQ) 				index += 4;
+			if (mask & VESC_VALUE_DUTY) 			data.dutyCycleNow 		= buffer_get_float16(message, 1000.0, &index);
+			if (mask & VESC_VALUE_RPM) 				data.rpm 				= buffer_get_float32(message, 1.0, &index);
+			if (mask & VESC_VALUE_INPUT_VOLTAGE) 	data.inpVoltage 		= buffer_get_float16(message, 10.0, &index);
+			if (mask & VESC_VALUE_AMP_HOURS) 		data.ampHours 			= buffer_get_float32(message, 10000.0, &index);
+			if (mask & VESC_VALUE_AMP_HOURS_CHARGED) data.ampHoursCharged 	= buffer_get_float32(message, 10000.0, &index);
+			if (mask & VESC_VALUE_WATT_HOURS) 		data.wattHours 			= buffer_get_float32(message, 10000.0, &index);
+			if (mask & VESC_VALUE_WATT_HOURS_CHARGED) data.wattHoursCharged = buffer_get_float32(message, 10000.0, &index);
+			if (mask & VESC_VALUE_TACHOMETER) 		data.tachometer 		= buffer_get_int32(message, &index);
+			if (mask & VESC_VALUE_TACHOMETER_ABS) 	data.tachometerAbs 		= buffer_get_int32(message, &index);
+			if (mask & VESC_VALUE_FAULT) 			data.error 				= (mc_fault_code)message[index++];
+			if (mask & VESC_VALUE_PID_POS) 			data.pidPos 			= buffer_get_float32(message, 1000000.0, &index);
+			if (mask & VESC_VALUE_CONTROLLER_ID) 	data.id 				= message[index++];
+			// Higher bits (newer firmware) follow and are ignored
 
-			uint32_t mask = 0xFFFFFFFF; */
+			return true;
+		}
 
 		default:
 			return false;
@@ -273,6 +872,126 @@ bool VescUart::processReadPacket(uint8_t * message) {
 	}
 }
 
+// Number of payload bytes of each field of COMM_GET_VALUES_SELECTIVE, by mask bit
+static const uint8_t selective_value_size[] = { 2, 2, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, 4, 1, 4, 1 };
+
+int VescUart::selectiveValuesLength(uint32_t mask) {
+	int length = 0;
+	for (uint8_t bit = 0; bit < sizeof(selective_value_size); bit++) {
+		if (mask & ((uint32_t)1 << bit)) {
+			length += selective_value_size[bit];
+		}
+	}
+	return length;
+}
+
+bool VescUart::getVescValuesSelective(uint32_t mask) {
+	return getVescValuesSelective(mask, 0);
+}
+
+bool VescUart::getVescValuesSelective(uint32_t mask, uint8_t canId) {
+
+	if (debugPort!=NULL){
+		debugPort->println("Command: COMM_GET_VALUES_SELECTIVE "+String(canId));
+	}
+
+	// Only ask for fields that fit in struct dataPackage
+	mask &= VESC_VALUE_ALL;
+	if (mask == 0)
+		return false;
+
+	int32_t index = 0;
+	int payloadSize = (canId == 0 ? 5 : 7);
+	uint8_t payload[payloadSize];
+	if (canId != 0) {
+		payload[index++] = { COMM_FORWARD_CAN };
+		payload[index++] = canId;
+	}
+	payload[index++] = { COMM_GET_VALUES_SELECTIVE };
+	buffer_append_uint32(payload, mask, &index);
+
+#if VESC_PREDICTOR_NODES > 0
+	uint32_t requestTime = microsSource();
+#endif
+	packSendPayload(payload, payloadSize);
+
+	uint8_t message[256];
+	int messageLength = receiveUartMessage(message);
+
+	if (messageLength > 0 && processReadPacket(message, messageLength)) {
+#if VESC_PREDICTOR_NODES > 0
+		// Selective polling is the fast path, feed the predictor from it as well
+		if (mask & (VESC_VALUE_RPM | VESC_VALUE_MOTOR_CURRENT | VESC_VALUE_DUTY))
+			updatePrediction(canId, requestTime + (microsSource() - requestTime) / 2, mask);
+#endif
+		notifySubscribers(message[0], canId);
+		return true;
+	}
+	return false;
+}
+
+uint32_t VescUart::subscribedValues(uint8_t canId) {
+	uint32_t mask = 0;
+	for (uint8_t i = 0; i < VESC_MAX_SUBSCRIBERS; i++) {
+		const subscriber & sub = subscribers[i];
+		if (sub.callback != NULL
+			&& (sub.packetId == VESC_SUBSCRIBE_ANY || sub.packetId == COMM_GET_VALUES_SELECTIVE)
+			&& (sub.canId == VESC_SUBSCRIBE_ANY || sub.canId == canId)) {
+			mask |= sub.fields;
+		}
+	}
+	return mask & VESC_VALUE_ALL;
+}
+
+bool VescUart::getSubscribedValues(void) {
+	return getSubscribedValues(0);
+}
+
+bool VescUart::getSubscribedValues(uint8_t canId) {
+	// The plan is recomputed on every call, so subscription changes apply immediately
+	uint32_t mask = subscribedValues(canId);
+	if (mask == 0)
+		return false;
+	return getVescValuesSelective(mask, canId);
+}
+
+bool VescUart::subscribe(uint8_t packetId, uint8_t canId, vescPacketCallback callback, void * context, uint32_t fields) {
+
+	if (callback == NULL)
+		return false;
+
+	for (uint8_t i = 0; i < VESC_MAX_SUBSCRIBERS; i++) {
+		if (subscribers[i].callback == NULL) {
+			subscribers[i].packetId = packetId;
+			subscribers[i].canId = canId;
+			subscribers[i].callback = callback;
+			subscribers[i].context = context;
+			subscribers[i].fields = fields;
+			return true;
+		}
+	}
+	return false; // Table full
+}
+
+void VescUart::unsubscribe(vescPacketCallback callback, void * context) {
+	for (uint8_t i = 0; i < VESC_MAX_SUBSCRIBERS; i++) {
+		if (subscribers[i].callback == callback && subscribers[i].context == context) {
+			subscribers[i].callback = NULL;
+		}
+	}
+}
+
+void VescUart::notifySubscribers(uint8_t packetId, uint8_t canId) {
+	for (uint8_t i = 0; i < VESC_MAX_SUBSCRIBERS; i++) {
+		subscriber & sub = subscribers[i];
+		if (sub.callback != NULL
+			&& (sub.packetId == VESC_SUBSCRIBE_ANY || sub.packetId == packetId)
+			&& (sub.canId == VESC_SUBSCRIBE_ANY || sub.canId == canId)) {
+			sub.callback(*this, packetId, canId, sub.context);
+		}
+	}
+}
+
 bool VescUart::getFWversion(void){
 	return getFWversion(0);
 }
@@ -293,12 +1012,39 @@ bool VescUart::getFWversion(uint8_t canId){
 
 	uint8_t message[256];
 	int messageLength = receiveUartMessage(message);
-	if (messageLength > 0) { 
-		return processReadPacket(message); 
+	if (messageLength > 0 && processReadPacket(message, messageLength)) { 
+		notifySubscribers(message[0], canId);
+		return true;
 	}
 	return false;
 }
 
+uint32_t VescUart::probeLatency(void){
+	return probeLatency(0);
+}
+
+uint32_t VescUart::probeLatency(uint8_t canId){
+
+	if (serialPort == NULL)
+		return 0;
+
+	// Drop stale bytes so an old reply is not mistaken for ours
+	while (serialPort->available()) {
+		serialPort->read();
+	}
+
+	uint32_t start = microsSource();
+	if (!getFWversion(canId)) {
+		return 0;
+	}
+	uint32_t rtt = microsSource() - start;
+
+	if (debugPort != NULL) {
+		debugPort->print("Round trip (us): "); debugPort->println(rtt);
+	}
+	return rtt;
+}
+
 bool VescUart::getVescValues(void) {
 	return getVescValues(0);
 }
@@ -318,16 +1064,118 @@ bool VescUart::getVescValues(uint8_t canId) {
 	}
 	payload[index++] = { COMM_GET_VALUES };
 
+#if VESC_PREDICTOR_NODES > 0
+	uint32_t requestTime = microsSource();
+#endif
 	packSendPayload(payload, payloadSize);
 
 	uint8_t message[256];
 	int messageLength = receiveUartMessage(message);
 
-	if (messageLength > 55) {
-		return processReadPacket(message); 
+	if (messageLength > 55 && processReadPacket(message, messageLength)) {
+#if VESC_PREDICTOR_NODES > 0
+		// The VESC samples its values roughly half a round trip after the request
+		updatePrediction(canId, requestTime + (microsSource() - requestTime) / 2);
+#endif
+		notifySubscribers(message[0], canId);
+		return true;
 	}
 	return false;
 }
+
+#if VESC_PREDICTOR_NODES > 0
+VescUart::predictorState * VescUart::findPredictor(uint8_t canId, bool create)
+{
+	for (uint8_t i = 0; i < VESC_PREDICTOR_NODES; i++) {
+		if (predictors[i].valid && predictors[i].canId == canId) {
+			return &predictors[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	predictorState * entry = &predictors[predictorNext];
+	predictorNext = (predictorNext + 1) % VESC_PREDICTOR_NODES;
+	memset(entry, 0, sizeof(predictorState));
+	entry->canId = canId;
+	entry->valid = true;
+	return entry;
+}
+
+void VescUart::updatePrediction(uint8_t canId, uint32_t timestamp, uint32_t fields) {
+
+	predictorState * entry = findPredictor(canId, true);
+	predictorLast = canId;
+
+	// Selective samples only move the histories of the fields they carry
+	if (fields & VESC_VALUE_RPM)
+		updateTrack(entry->rpm, data.rpm, timestamp);
+	if (fields & VESC_VALUE_MOTOR_CURRENT)
+		updateTrack(entry->current, data.avgMotorCurrent, timestamp);
+	if (fields & VESC_VALUE_DUTY)
+		updateTrack(entry->duty, data.dutyCycleNow, timestamp);
+}
+
+void VescUart::updateTrack(predictorTrack & track, float value, uint32_t timestamp) {
+
+	if (track.samples > 0) {
+		uint32_t interval = timestamp - track.timestamp;
+		if (interval > 0) {
+			float dt = interval * 1e-6f;
+			// Exponentially smoothed slope, O(1) per sample. The first slope is taken as is.
+			float keep = (track.samples < 2 ? 0.0f : 0.5f);
+			track.slope = keep * track.slope + (1.0f - keep) * (value - track.value) / dt;
+			track.interval = interval;
+		}
+	}
+
+	if (track.samples < 2)
+		track.samples++;
+
+	track.timestamp = timestamp;
+	track.value = value;
+}
+
+float VescUart::predictTrack(const predictorTrack & track, uint32_t atMicros) {
+
+	// Extrapolate at most one sample interval ahead, hold the value beyond that
+	int32_t ahead = (int32_t)(atMicros - track.timestamp);
+	if (track.samples < 2 || ahead <= 0) {
+		ahead = 0;
+	} else if ((uint32_t)ahead > track.interval) {
+		ahead = track.interval;
+	}
+	return track.value + track.slope * (ahead * 1e-6f);
+}
+
+bool VescUart::predictVescValues(void) {
+	return predictVescValues(microsSource(), predictorLast);
+}
+
+bool VescUart::predictVescValues(uint32_t atMicros) {
+	return predictVescValues(atMicros, predictorLast);
+}
+
+bool VescUart::predictVescValues(uint32_t atMicros, uint8_t canId) {
+
+	predictorState * entry = findPredictor(canId, false);
+	if (entry == NULL)
+		return false;
+
+	prediction.canId = canId;
+	prediction.timestamp = entry->rpm.timestamp;
+	if ((int32_t)(entry->current.timestamp - prediction.timestamp) > 0)
+		prediction.timestamp = entry->current.timestamp;
+	if ((int32_t)(entry->duty.timestamp - prediction.timestamp) > 0)
+		prediction.timestamp = entry->duty.timestamp;
+
+	prediction.rpm 				= predictTrack(entry->rpm, atMicros);
+	prediction.avgMotorCurrent 	= predictTrack(entry->current, atMicros);
+	prediction.dutyCycleNow 	= predictTrack(entry->duty, atMicros);
+	return true;
+}
+#endif
 void VescUart::setNunchuckValues() {
 	return setNunchuckValues(0);
 }
@@ -385,6 +1233,45 @@ void VescUart::setCurrent(float current, uint8_t canId) {
 	packSendPayload(payload, payloadSize);
 }
 
+void VescUart::setCurrents(const float * currents, const uint8_t * canIds, int count) {
+
+	if (currents == NULL || canIds == NULL || count <= 0) {
+		return;
+	}
+
+	uint8_t messageSend[256];
+	int length = 0;
+
+	for (int i = 0; i < count; i++) {
+		int32_t index = 0;
+		uint8_t payload[7];
+		if (canIds[i] != 0) {
+			payload[index++] = { COMM_FORWARD_CAN };
+			payload[index++] = canIds[i];
+		}
+		payload[index++] = { COMM_SET_CURRENT };
+		buffer_append_int32(payload, (int32_t)(currents[i] * 1000), &index);
+
+		// Flush when the next frame (payload + 5 bytes framing) does not fit anymore
+		if (length + index + 5 > (int)sizeof(messageSend)) {
+			writeFrames(messageSend, length);
+			length = 0;
+		}
+		length += packPayload(payload, index, messageSend + length, sizeof(messageSend) - length);
+		trace(VESC_TRACE_TX, payload, index);
+	}
+
+	if (length == 0) {
+		return;
+	}
+
+	if(debugPort!=NULL){
+		debugPort->print("Packages to send: "); serialPrint(messageSend, length);
+	}
+
+	writeFrames(messageSend, length);
+}
+
 void VescUart::setBrakeCurrent(float brakeCurrent) {
 	return setBrakeCurrent(brakeCurrent, 0);
 }
@@ -481,6 +1368,245 @@ void VescUart::printVescValues() {
 		debugPort->print("tachometerAbs: "); 	debugPort->println(data.tachometerAbs);
 		debugPort->print("tempMosfet: "); 		debugPort->println(data.tempMosfet);
 		debugPort->print("tempMotor: "); 		debugPort->println(data.tempMotor);
+		debugPort->print("pidPos: "); 			debugPort->println(data.pidPos);
+		debugPort->print("id: "); 				debugPort->println(data.id);
 		debugPort->print("error: "); 			debugPort->println(data.error);
 	}
 }
+
+static const uint32_t serialize_pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+static bool serialize_append_str(char * buffer, int len, int32_t * index, const char * str) {
+	while (*str) {
+		if (*index >= len - 1) {
+			return false;
+		}
+		buffer[(*index)++] = *str++;
+	}
+	return true;
+}
+
+// Writes at least minDigits digits, zero-padded on the left
+static bool serialize_append_uint(char * buffer, int len, int32_t * index, uint32_t number, uint8_t minDigits) {
+	char digits[10];
+	uint8_t count = 0;
+
+	do {
+		digits[count++] = '0' + (number % 10);
+		number /= 10;
+	} while (number > 0 || count < minDigits);
+
+	if (*index + count >= len) {
+		return false;
+	}
+	while (count > 0) {
+		buffer[(*index)++] = digits[--count];
+	}
+	return true;
+}
+
+static bool serialize_append_int(char * buffer, int len, int32_t * index, int32_t number) {
+	uint32_t magnitude = (uint32_t)number;
+
+	if (number < 0) {
+		if (!serialize_append_str(buffer, len, index, "-")) {
+			return false;
+		}
+		magnitude = 0 - magnitude;
+	}
+	return serialize_append_uint(buffer, len, index, magnitude, 1);
+}
+
+// Fixed-precision formatting. All values are decoded from fixed-point on the wire,
+// so printing them with the wire scale as precision is exact.
+static bool serialize_append_float(char * buffer, int len, int32_t * index, float number, uint8_t decimals, uint8_t format) {
+
+	if (isnan(number) || isinf(number) || fabsf(number) >= 4.0e9f) {
+		return format == VESC_SERIALIZE_JSON ? serialize_append_str(buffer, len, index, "null") : true;
+	}
+
+	bool negative = number < 0;
+	if (negative) {
+		number = -number;
+	}
+
+	uint32_t integral = (uint32_t)number;
+	uint32_t fraction = (uint32_t)((number - (float)integral) * serialize_pow10[decimals] + 0.5f);
+
+	if (fraction >= serialize_pow10[decimals]) {
+		integral++;
+		fraction -= serialize_pow10[decimals];
+	}
+
+	// No "-0.0" for values that round to zero
+	if (negative && (integral > 0 || fraction > 0)) {
+		if (!serialize_append_str(buffer, len, index, "-")) {
+			return false;
+		}
+	}
+
+	if (!serialize_append_uint(buffer, len, index, integral, 1)) {
+		return false;
+	}
+	if (decimals == 0) {
+		return true;
+	}
+	return serialize_append_str(buffer, len, index, ".")
+		&& serialize_append_uint(buffer, len, index, fraction, decimals);
+}
+
+// Writes the separator and, depending on the format, the field name. The separator depends on the
+// field position only, as a CSV value may be empty.
+static bool serialize_append_key(char * buffer, int len, int32_t * index, uint8_t * field, const char * name, uint8_t format) {
+
+	if ((*field)++ > 0) {
+		if (!serialize_append_str(buffer, len, index, ",")) {
+			return false;
+		}
+	}
+
+	switch (format) {
+		case VESC_SERIALIZE_JSON:
+			return serialize_append_str(buffer, len, index, "\"")
+				&& serialize_append_str(buffer, len, index, name)
+				&& serialize_append_str(buffer, len, index, "\":");
+		case VESC_SERIALIZE_CSV_HEADER:
+			return serialize_append_str(buffer, len, index, name);
+		default:
+			return true;
+	}
+}
+
+static bool serialize_float_field(char * buffer, int len, int32_t * index, uint8_t * field, const char * name, float value, uint8_t decimals, uint8_t format) {
+	if (!serialize_append_key(buffer, len, index, field, name, format)) {
+		return false;
+	}
+	return format == VESC_SERIALIZE_CSV_HEADER || serialize_append_float(buffer, len, index, value, decimals, format);
+}
+
+static bool serialize_int_field(char * buffer, int len, int32_t * index, uint8_t * field, const char * name, int32_t value, uint8_t format) {
+	if (!serialize_append_key(buffer, len, index, field, name, format)) {
+		return false;
+	}
+	return format == VESC_SERIALIZE_CSV_HEADER || serialize_append_int(buffer, len, index, value);
+}
+
+#if VESC_TRACE_SIZE > 0
+static_assert((VESC_TRACE_SIZE & (VESC_TRACE_SIZE - 1)) == 0 && VESC_TRACE_SIZE <= 32768,
+	"VESC_TRACE_SIZE must be a power of two up to 32768");
+#endif
+
+void VescUart::trace(uint8_t type, const uint8_t * payload, int lenPay) {
+#if VESC_TRACE_SIZE > 0
+	traceEvent & event = traceEvents[traceHead & (VESC_TRACE_SIZE - 1)];
+
+	event.timestamp = microsSource();
+	event.type = type;
+	event.packetId = 0xFF;
+	event.canId = 0;
+	event.length = (lenPay > 0 && lenPay < 256 ? lenPay : 0);
+
+	if (payload != NULL && lenPay > 0) {
+		event.packetId = payload[0];
+		// Report the forwarded command instead of COMM_FORWARD_CAN
+		if (payload[0] == COMM_FORWARD_CAN && lenPay > 2) {
+			event.canId = payload[1];
+			event.packetId = payload[2];
+		}
+	}
+
+	// Overwrite the oldest event when the reader falls behind
+	if ((uint16_t)(traceHead - traceTail) >= VESC_TRACE_SIZE) {
+		traceTail++;
+		traceDropped++;
+	}
+	traceHead++;
+#else
+	(void)type; (void)payload; (void)lenPay;
+#endif
+}
+
+#if VESC_TRACE_SIZE > 0
+static const char * const trace_names[] = { "TX", "RX", "CRC error", "Framing error", "Timeout" };
+
+int VescUart::serializeTrace(char * buffer, int len) {
+
+	// SAFETY CHECK: Validate parameters
+	if (buffer == NULL || len <= 0) {
+		return 0;
+	}
+
+	int32_t index = 0;
+
+	while (traceTail != traceHead) {
+		const traceEvent & event = traceEvents[traceTail & (VESC_TRACE_SIZE - 1)];
+		int32_t start = index;
+
+		bool ok = serialize_append_str(buffer, len, &index, "{\"name\":\"")
+			&& serialize_append_str(buffer, len, &index, trace_names[event.type])
+			&& serialize_append_str(buffer, len, &index, "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":")
+			&& serialize_append_int(buffer, len, &index, event.canId)
+			&& serialize_append_str(buffer, len, &index, ",\"ts\":")
+			&& serialize_append_uint(buffer, len, &index, event.timestamp, 1)
+			&& serialize_append_str(buffer, len, &index, ",\"args\":{\"packet\":")
+			&& serialize_append_int(buffer, len, &index, event.packetId)
+			&& serialize_append_str(buffer, len, &index, ",\"len\":")
+			&& serialize_append_int(buffer, len, &index, event.length)
+			&& serialize_append_str(buffer, len, &index, "}},\n");
+
+		if (!ok) {
+			index = start; // Keep the event for the next call
+			break;
+		}
+		traceTail++;
+	}
+
+	buffer[index] = 0;
+	return index;
+}
+#endif
+
+int VescUart::serializeVescValues(char * buffer, int len, uint8_t format) {
+
+	// SAFETY CHECK: Validate parameters
+	if (buffer == NULL || len <= 0 || format > VESC_SERIALIZE_CSV_HEADER) {
+		return 0;
+	}
+
+	int32_t index = 0;
+	uint8_t field = 0;
+	bool ok = true;
+
+	// Precision follows the scale used for each field in COMM_GET_VALUES
+	if (format == VESC_SERIALIZE_JSON) {
+		ok = serialize_append_str(buffer, len, &index, "{");
+	}
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "avgMotorCurrent", 	data.avgMotorCurrent, 	2, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "avgInputCurrent", 	data.avgInputCurrent, 	2, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "dutyCycleNow", 		data.dutyCycleNow, 		3, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "rpm", 				data.rpm, 				0, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "inpVoltage", 		data.inpVoltage, 		1, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "ampHours", 			data.ampHours, 			4, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "ampHoursCharged", 	data.ampHoursCharged, 	4, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "wattHours", 			data.wattHours, 		4, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "wattHoursCharged", 	data.wattHoursCharged, 	4, format);
+	ok = ok && serialize_int_field(buffer, len, &index, &field, "tachometer", 			data.tachometer, 		format);
+	ok = ok && serialize_int_field(buffer, len, &index, &field, "tachometerAbs", 		data.tachometerAbs, 	format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "tempMosfet", 		data.tempMosfet, 		1, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "tempMotor", 			data.tempMotor, 		1, format);
+	ok = ok && serialize_float_field(buffer, len, &index, &field, "pidPos", 			data.pidPos, 			6, format);
+	ok = ok && serialize_int_field(buffer, len, &index, &field, "id", 					data.id, 				format);
+	ok = ok && serialize_int_field(buffer, len, &index, &field, "error", 				data.error, 			format);
+	if (format == VESC_SERIALIZE_JSON) {
+		ok = ok && serialize_append_str(buffer, len, &index, "}");
+	}
+	ok = ok && serialize_append_str(buffer, len, &index, "\n");
+
+	if (!ok) {
+		buffer[0] = 0;
+		return 0;
+	}
+
+	buffer[index] = 0;
+	return index;
+}
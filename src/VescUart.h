@@ -6,6 +6,107 @@
 #include "buffer.h"
 #include "crc.h"
 
+/** Output formats for VescUart::serializeVescValues() */
+#define VESC_SERIALIZE_JSON			0
+#define VESC_SERIALIZE_CSV			1
+#define VESC_SERIALIZE_CSV_HEADER	2
+
+/** Buffer size for serializeVescValues() that fits any line, the longest JSON line is 375 characters */
+#define VESC_SERIALIZE_MAX_LENGTH	384
+
+/** Field mask bits of COMM_GET_VALUES_SELECTIVE, in wire order */
+#define VESC_VALUE_TEMP_MOSFET				((uint32_t)1 << 0)
+#define VESC_VALUE_TEMP_MOTOR				((uint32_t)1 << 1)
+#define VESC_VALUE_MOTOR_CURRENT			((uint32_t)1 << 2)
+#define VESC_VALUE_INPUT_CURRENT			((uint32_t)1 << 3)
+#define VESC_VALUE_ID						((uint32_t)1 << 4)
+#define VESC_VALUE_IQ						((uint32_t)1 << 5)
+#define VESC_VALUE_DUTY						((uint32_t)1 << 6)
+#define VESC_VALUE_RPM						((uint32_t)1 << 7)
+#define VESC_VALUE_INPUT_VOLTAGE			((uint32_t)1 << 8)
+#define VESC_VALUE_AMP_HOURS				((uint32_t)1 << 9)
+#define VESC_VALUE_AMP_HOURS_CHARGED		((uint32_t)1 << 10)
+#define VESC_VALUE_WATT_HOURS				((uint32_t)1 << 11)
+#define VESC_VALUE_WATT_HOURS_CHARGED		((uint32_t)1 << 12)
+#define VESC_VALUE_TACHOMETER				((uint32_t)1 << 13)
+#define VESC_VALUE_TACHOMETER_ABS			((uint32_t)1 << 14)
+#define VESC_VALUE_FAULT					((uint32_t)1 << 15)
+#define VESC_VALUE_PID_POS					((uint32_t)1 << 16)
+#define VESC_VALUE_CONTROLLER_ID			((uint32_t)1 << 17)
+#define VESC_VALUE_ALL						(((uint32_t)1 << 18) - 1)
+
+/** Number of consumers that can subscribe to decoded packets, override with a build flag (-D) so the library and sketch agree */
+#ifndef VESC_MAX_SUBSCRIBERS
+#define VESC_MAX_SUBSCRIBERS		4
+#endif
+
+/** Wildcard for the packet ID or CAN ID of a subscription */
+#define VESC_SUBSCRIBE_ANY			0xFF
+
+/** Number of protocol events kept for serializeTrace(), a power of two up to 32768. 0 compiles tracing out.
+  * Set it with a build flag (-D) so the library and sketch agree. */
+#ifndef VESC_TRACE_SIZE
+#define VESC_TRACE_SIZE				0
+#endif
+
+/** Event types recorded by the tracer */
+#define VESC_TRACE_TX				0	// Frame written to the serial port
+#define VESC_TRACE_RX				1	// Frame received with a valid CRC
+#define VESC_TRACE_CRC_ERROR		2	// Frame received with a bad CRC
+#define VESC_TRACE_FRAMING_ERROR	3	// Frame dropped because of a wrong end byte
+#define VESC_TRACE_TIMEOUT			4	// No reply before the timeout
+
+/** Set to 1 with a build flag (-D) to count CPU cycles spent in each phase of the library */
+#ifndef VESC_PROFILE
+#define VESC_PROFILE				0
+#endif
+
+/** Phases measured when VESC_PROFILE is enabled, encode includes its CRC and copy */
+#define VESC_PHASE_PARSE			0	// Framing of received bytes
+#define VESC_PHASE_CRC				1
+#define VESC_PHASE_COPY				2	// memcpy of payloads
+#define VESC_PHASE_DECODE			3	// processReadPacket()
+#define VESC_PHASE_ENCODE			4	// Framing of payloads to send
+#define VESC_PHASE_WRITE			5	// Stream::write()
+#define VESC_PHASE_COUNT			6
+
+/** Number of (packet ID, CAN ID) pairs with their own round trip estimate for adaptive timeouts.
+  * 0 compiles adaptive timeouts out. Set it with a build flag (-D) so the library and sketch agree. */
+#ifndef VESC_RTT_ENTRIES
+#define VESC_RTT_ENTRIES			0
+#endif
+
+/** Number of CAN nodes with their own predictor history, see predictVescValues(). 0 compiles
+  * the predictor out. Set it with a build flag (-D) so the library and sketch agree. */
+#ifndef VESC_PREDICTOR_NODES
+#define VESC_PREDICTOR_NODES		0
+#endif
+
+/** Size in bytes of the transmit queue, a power of two. 0 writes frames directly (blocking).
+  * Ports that report no room in availableForWrite() when set (e.g. SoftwareSerial) keep using
+  * blocking writes. Set it with a build flag (-D). */
+#ifndef VESC_TX_BUFFER_SIZE
+#define VESC_TX_BUFFER_SIZE			0
+#endif
+
+/** Bytes shared by all instances for frames longer than 256 bytes (start byte 3). 0 rejects such
+  * frames. The arena is split in VESC_LARGE_FRAME_SLOTS slots that are borrowed only while a
+  * large frame is received. Set both with build flags (-D). */
+#ifndef VESC_LARGE_FRAME_ARENA
+#define VESC_LARGE_FRAME_ARENA		0
+#endif
+
+#ifndef VESC_LARGE_FRAME_SLOTS
+#define VESC_LARGE_FRAME_SLOTS		1
+#endif
+
+#define VESC_LARGE_FRAME_SLOT_SIZE	(VESC_LARGE_FRAME_ARENA / VESC_LARGE_FRAME_SLOTS)
+
+class VescUart;
+
+/** Called with the instance holding the decoded packet (data, fw_version), no copy is made */
+typedef void (*vescPacketCallback)(const VescUart & vesc, uint8_t packetId, uint8_t canId, void * context);
+
 class VescUart
 {
 
@@ -42,6 +143,88 @@ class VescUart
         uint8_t minor;
     };
 
+	/** Struct to hold values extrapolated to a point in time from recent telemetry */
+	struct predictionPackage {
+		float rpm;
+		float avgMotorCurrent;
+		float dutyCycleNow;
+		uint8_t canId;			// Node the prediction is based on
+		uint32_t timestamp;		// micros() at which the last sample was taken by the VESC
+	};
+
+	/** Struct to hold the history of one predicted value, only the last sample and smoothed slope */
+	struct predictorTrack {
+		float value;
+		float slope;
+		uint32_t timestamp;
+		uint32_t interval;
+		uint8_t samples;
+	};
+
+	/** Struct to hold the predictor history of one CAN node */
+	struct predictorState {
+		uint8_t canId;
+		uint8_t valid;
+		predictorTrack rpm, current, duty;
+	};
+
+	/** Struct to hold one entry of the subscriber table */
+	struct subscriber {
+		uint8_t packetId;
+		uint8_t canId;
+		vescPacketCallback callback;
+		void * context;
+		uint32_t fields;	// VESC_VALUE_* bits needed, used by getSubscribedValues()
+	};
+
+	/** Struct to hold one trace event */
+	struct traceEvent {
+		uint32_t timestamp;	// micros()
+		uint8_t type;		// VESC_TRACE_*
+		uint8_t packetId;
+		uint8_t canId;		// 0 for the local VESC and for replies
+		uint8_t length;		// Payload length
+	};
+
+#if VESC_PROFILE
+	friend class profileScope;
+#endif
+
+	/** Struct to hold the cycle counts of one phase */
+	struct profilePackage {
+		uint32_t count;		// Number of times the phase ran
+		uint64_t total;		// Cycles spent in total
+		uint32_t max;		// Longest single run in cycles
+	};
+
+	/** Struct to hold the round trip estimate of one request type, in microseconds */
+	struct rttEntry {
+		uint8_t packetId;
+		uint8_t canId;
+		uint8_t valid;
+		uint8_t backoff;	// Doubles the timeout after each consecutive timeout
+		uint32_t srtt;		// Smoothed round trip time
+		uint32_t rttvar;	// Smoothed mean deviation
+	};
+
+	/** Struct to hold the usage of the shared large frame arena */
+	struct arenaPackage {
+		uint8_t inUse;			// Slots borrowed right now
+		uint8_t peakInUse;		// Most slots borrowed at the same time
+		uint32_t peakLength;	// Longest frame stored
+		uint32_t borrows;		// Successful borrows
+		uint32_t failures;		// Frames dropped: all slots busy or frame larger than a slot
+	};
+
+	/** Struct to hold the link statistics of received messages */
+	struct statsPackage {
+		uint32_t framesReceived;	// Frames with a valid CRC
+		uint32_t crcErrors;			// Complete frames with a bad CRC
+		uint32_t framingErrors;		// Frames dropped because of a wrong end byte
+		uint32_t bytesDiscarded;	// Noise bytes skipped while looking for a start byte
+		uint32_t timeouts;			// Requests without a complete frame before the timeout
+	};
+
 	//Timeout - specifies how long the function will wait for the vesc to respond
 	const uint32_t _TIMEOUT;
 
@@ -60,6 +243,38 @@ class VescUart
        /** Variable to hold firmware version */
         FWversionPackage fw_version; 
 
+#if VESC_PREDICTOR_NODES > 0
+        /** Variable to hold the values computed by predictVescValues() */
+        predictionPackage prediction;
+#endif
+
+        /** Variable to hold the receive statistics, used to measure goodput on noisy links */
+        statsPackage stats;
+
+        /**
+         * @brief      Reset the receive statistics
+         */
+        void resetStats(void);
+
+#if VESC_RTT_ENTRIES > 0
+        /**
+         * @brief      Derive each request's timeout from the measured round trip time (TCP-style
+         *             SRTT + 4 * RTTVAR) per packet ID and CAN ID, instead of the fixed constructor timeout
+         * @param      floor_ms    - Lower bound of the timeout
+         * @param      ceiling_ms  - Upper bound, also used before the first reply. 0 disables adaptation
+         */
+        void setAdaptiveTimeout(uint32_t floor_ms, uint32_t ceiling_ms);
+#endif
+
+        /**
+         * @brief      The timeout the next request of this kind would use
+         * @param      packetId  - The COMM_PACKET_ID of the request
+         * @param      canId     - The CAN ID of the VESC, 0 for the local VESC
+         *
+         * @return     Timeout in milliseconds
+         */
+        uint32_t getTimeout(uint8_t packetId, uint8_t canId);
+
         /**
          * @brief      Set the serial port for uart communication
          * @param      port  - Reference to Serial port (pointer) 
@@ -72,6 +287,36 @@ class VescUart
          */
         void setDebugPort(Stream* port);
 
+        /**
+         * @brief      Set the clock used for timeouts, defaults to millis() and micros()
+         *             Together with an in-memory Stream this allows running the library
+         *             against a simulated link and a virtual clock.
+         * @param      timeSource        - Function returning the current time in milliseconds
+         * @param      microsTimeSource  - Same clock in microseconds, used to measure round trips and stamp trace events
+         */
+        void setTimeSource(unsigned long (*timeSource)(void), unsigned long (*microsTimeSource)(void) = NULL);
+
+        /**
+         * @brief      Register a consumer that is called whenever a matching packet has been decoded.
+         *             All consumers share the same decoded data, there is no per-consumer copy.
+         *
+         * @param      packetId  - COMM_PACKET_ID to listen for, or VESC_SUBSCRIBE_ANY
+         * @param      canId     - CAN ID to listen for (0 for the local VESC), or VESC_SUBSCRIBE_ANY
+         * @param      callback  - Function to call
+         * @param      context   - Pointer handed back to the callback
+         * @param      fields    - VESC_VALUE_* bits the consumer needs, see getSubscribedValues()
+         * @return     True if registered, false if all VESC_MAX_SUBSCRIBERS slots are in use
+         */
+        bool subscribe(uint8_t packetId, uint8_t canId, vescPacketCallback callback, void * context = NULL, uint32_t fields = VESC_VALUE_ALL);
+
+        /**
+         * @brief      Remove a consumer registered with subscribe()
+         *
+         * @param      callback  - Function passed to subscribe()
+         * @param      context   - Pointer passed to subscribe()
+         */
+        void unsubscribe(vescPacketCallback callback, void * context = NULL);
+
         /**
          * @brief      Populate the firmware version variables
          *
@@ -87,6 +332,23 @@ class VescUart
          */
         bool getFWversion(uint8_t canId);
 
+        /**
+         * @brief      Measure the round trip time of the link with a COMM_FW_VERSION request
+         *             Includes UART, USB-serial adapter and CAN forwarding latency, so
+         *             misconfigured adapters (e.g. FTDI latency timer) become visible.
+         *
+         * @return     Round trip time in microseconds, 0 if no reply was received
+         */
+        uint32_t probeLatency(void);
+
+        /**
+         * @brief      Measure the round trip time of the link with a COMM_FW_VERSION request
+         *
+         * @param      canId  - The CAN ID of the VESC
+         * @return     Round trip time in microseconds, 0 if no reply was received
+         */
+        uint32_t probeLatency(uint8_t canId);
+
         /**
          * @brief      Sends a command to VESC and stores the returned data
          *
@@ -102,6 +364,75 @@ class VescUart
          */
         bool getVescValues(uint8_t canId);
 
+        /**
+         * @brief      Requests only the fields in mask and stores them in data, other fields keep their value
+         * @param      mask  - VESC_VALUE_* bits of the fields to request
+         *
+         * @return     True if successfull otherwise false
+         */
+        bool getVescValuesSelective(uint32_t mask);
+
+        /**
+         * @brief      Requests only the fields in mask and stores them in data, other fields keep their value
+         * @param      mask   - VESC_VALUE_* bits of the fields to request
+         * @param      canId  - The CAN ID of the VESC
+         *
+         * @return     True if successfull otherwise false
+         */
+        bool getVescValuesSelective(uint32_t mask, uint8_t canId);
+
+        /**
+         * @brief      Union of the fields subscribed to with COMM_GET_VALUES_SELECTIVE for a node
+         * @param      canId  - The CAN ID of the VESC
+         *
+         * @return     VESC_VALUE_* bits, 0 if nobody subscribed
+         */
+        uint32_t subscribedValues(uint8_t canId);
+
+        /**
+         * @brief      Requests exactly the fields the subscribers of the local VESC need
+         *
+         * @return     True if successfull otherwise false
+         */
+        bool getSubscribedValues(void);
+
+        /**
+         * @brief      Requests exactly the fields the subscribers of a node need
+         * @param      canId  - The CAN ID of the VESC
+         *
+         * @return     True if successfull otherwise false
+         */
+        bool getSubscribedValues(uint8_t canId);
+
+#if VESC_PREDICTOR_NODES > 0
+        /**
+         * @brief      Extrapolate rpm, motor current and duty of the node polled last to now from
+         *             the recent samples of getVescValues() and getVescValuesSelective(),
+         *             compensating for the age of the data
+         *
+         * @return     True if a sample was available, the result is stored in prediction
+         */
+        bool predictVescValues(void);
+
+        /**
+         * @brief      Extrapolate rpm, motor current and duty of the node polled last to the given time
+         * @param      atMicros  - Time (micros()) to predict for, at most one sample interval ahead
+         *
+         * @return     True if a sample was available, the result is stored in prediction
+         */
+        bool predictVescValues(uint32_t atMicros);
+
+        /**
+         * @brief      Extrapolate rpm, motor current and duty of a node to the given time. Each of
+         *             the last VESC_PREDICTOR_NODES polled nodes keeps its own history.
+         * @param      atMicros  - Time (micros()) to predict for, at most one sample interval ahead
+         * @param      canId     - The CAN ID of the VESC
+         *
+         * @return     True if a sample was available, the result is stored in prediction
+         */
+        bool predictVescValues(uint32_t atMicros, uint8_t canId);
+#endif
+
         /**
          * @brief      Sends values for joystick and buttons to the nunchuck app
          */
@@ -125,6 +456,14 @@ class VescUart
          */
         void setCurrent(float current, uint8_t canId);
 
+        /**
+         * @brief      Set the current of several motors with a single write to the serial port
+         * @param      currents  - The currents to apply
+         * @param      canIds    - The CAN IDs of the VESCs, 0 for the local VESC
+         * @param      count     - Number of entries in currents and canIds
+         */
+        void setCurrents(const float * currents, const uint8_t * canIds, int count);
+
         /**
          * @brief      Set the current to brake the motor
          * @param      brakeCurrent  - The current to apply
@@ -176,11 +515,79 @@ class VescUart
          */
         void sendKeepalive(uint8_t canId);
 
+#if VESC_LARGE_FRAME_ARENA > 0
+        /** Variable to hold the arena usage, shared by all instances */
+        static arenaPackage arena;
+
+        /** Payload of a frame longer than 256 bytes, only valid inside a subscriber callback */
+        const uint8_t * largePayload = NULL;
+        uint16_t largePayloadLength = 0;
+#endif
+
+#if VESC_TX_BUFFER_SIZE > 0
+        /**
+         * @brief      Writes queued frames as far as availableForWrite() permits, never blocks.
+         *             Call it from loop(), in the same context as the other methods; the queue
+         *             is not protected against interrupts.
+         */
+        void processTx(void);
+
+        /**
+         * @brief      Number of bytes waiting in the transmit queue
+         */
+        uint16_t txQueueDepth(void);
+
+        /** Variables to hold the transmit queue statistics */
+        uint32_t txDropped;		// Frames discarded because the queue was full
+        uint32_t txMerged;		// Queued setpoints replaced by a newer one for the same node
+        uint16_t txHighWater;	// Largest queue depth in bytes
+#endif
+
+#if VESC_PROFILE
+        /** Variable to hold the cycle counts per VESC_PHASE_*. Cycles come from DWT CYCCNT on
+          * Cortex-M3/M4/M7, rdtsc on x86 and micros() scaled by F_CPU elsewhere. */
+        profilePackage profile[VESC_PHASE_COUNT];
+
+        /**
+         * @brief      Reset the cycle counts
+         */
+        void resetProfile(void);
+#endif
+
+#if VESC_TRACE_SIZE > 0
+        /**
+         * @brief      Moves recorded protocol events into a buffer as Chrome trace-event JSON.
+         *             Each event is written as one "{...},\n" line, the host prefixes the
+         *             stream with "[" to load it in chrome://tracing or Perfetto.
+         *
+         * @param      buffer  - Destination buffer, NULL-terminated
+         * @param      len     - Size of the destination buffer
+         * @return     The number of characters written, events that did not fit stay queued
+         */
+        int serializeTrace(char * buffer, int len);
+
+        /** Variable to hold the number of events overwritten before they were read */
+        uint32_t traceDropped;
+#endif
+
         /**
          * @brief      Help Function to print struct dataPackage over Serial for Debug
          */
         void printVescValues(void);
 
+        /**
+         * @brief      Formats struct dataPackage as a single text line into a caller buffer.
+         *             No heap allocations and no Arduino float printing is used, so it is
+         *             cheap enough to stream every sample to a host.
+         *
+         * @param      buffer  - Destination buffer, the line is NULL-terminated and ends with '\n'
+         * @param      len     - Size of the destination buffer, VESC_SERIALIZE_MAX_LENGTH always fits
+         * @param      format  - VESC_SERIALIZE_JSON, VESC_SERIALIZE_CSV or VESC_SERIALIZE_CSV_HEADER
+         * @return     The number of characters written (without NULL), 0 if the buffer is too small
+         *             and the line was dropped
+         */
+        int serializeVescValues(char * buffer, int len, uint8_t format = VESC_SERIALIZE_JSON);
+
 	private: 
 
 		/** Variable to hold the reference to the Serial object to use for UART */
@@ -190,6 +597,168 @@ class VescUart
 		  * Uses the class Stream instead of HarwareSerial */
 		Stream* debugPort = NULL;
 
+#if VESC_PREDICTOR_NODES > 0
+		/** Variables to hold the histories used by predictVescValues(), recycled round robin */
+		predictorState predictors[VESC_PREDICTOR_NODES];
+		uint8_t predictorNext = 0;
+		uint8_t predictorLast = 0;	// CAN ID of the node sampled last
+
+		/**
+		 * @brief      Looks up the predictor history of a node
+		 *
+		 * @param      canId   - The CAN ID of the VESC
+		 * @param      create  - Recycle the oldest entry if the node has none
+		 * @return     The entry, NULL if not found and create is false
+		 */
+		predictorState * findPredictor(uint8_t canId, bool create);
+
+		/**
+		 * @brief      Feeds the latest data sample to the predictor
+		 *
+		 * @param      canId      - The CAN ID the sample came from
+		 * @param      timestamp  - Estimated time (micros()) the sample was taken
+		 * @param      fields     - VESC_VALUE_* bits of the fields in the sample
+		 */
+		void updatePrediction(uint8_t canId, uint32_t timestamp, uint32_t fields = VESC_VALUE_ALL);
+
+		/**
+		 * @brief      Feeds one value to its history, smoothing the slope
+		 *
+		 * @param      track      - The history of the value
+		 * @param      value      - The sampled value
+		 * @param      timestamp  - Estimated time (micros()) the sample was taken
+		 */
+		void updateTrack(predictorTrack & track, float value, uint32_t timestamp);
+
+		/**
+		 * @brief      Extrapolates one value, holding it beyond one sample interval
+		 *
+		 * @param      track     - The history of the value
+		 * @param      atMicros  - Time (micros()) to predict for
+		 * @return     The extrapolated value
+		 */
+		float predictTrack(const predictorTrack & track, uint32_t atMicros);
+#endif
+
+		/** Variable to hold the registered consumers */
+		subscriber subscribers[VESC_MAX_SUBSCRIBERS];
+
+		/**
+		 * @brief      Payload length of the fields selected by a COMM_GET_VALUES_SELECTIVE mask
+		 *
+		 * @param      mask  - The echoed mask
+		 * @return     Number of bytes following the mask
+		 */
+		int selectiveValuesLength(uint32_t mask);
+
+		/**
+		 * @brief      Calls the consumers subscribed to the decoded packet
+		 *
+		 * @param      packetId  - The COMM_PACKET_ID of the decoded packet
+		 * @param      canId     - The CAN ID it came from
+		 */
+		void notifySubscribers(uint8_t packetId, uint8_t canId);
+
+#if VESC_TRACE_SIZE > 0
+		/** Ring buffer of trace events, written and read by index counters only */
+		traceEvent traceEvents[VESC_TRACE_SIZE];
+		volatile uint16_t traceHead;
+		volatile uint16_t traceTail;
+#endif
+
+		/**
+		 * @brief      Records a trace event, compiles to nothing when VESC_TRACE_SIZE is 0
+		 *
+		 * @param      type     - VESC_TRACE_* event type
+		 * @param      payload  - The payload of the frame, NULL if there is none
+		 * @param      lenPay   - Length of payload
+		 */
+		void trace(uint8_t type, const uint8_t * payload, int lenPay);
+
+#if VESC_TX_BUFFER_SIZE > 0
+		/** Ring buffer of framed messages waiting to be written */
+		uint8_t txBuffer[VESC_TX_BUFFER_SIZE];
+		uint16_t txHead;
+		uint16_t txTail;
+		uint16_t txFrameLeft;	// Bytes of the frame at txTail not written yet, 0 if not started
+		bool txQueueUsable;		// False if the port does not implement availableForWrite()
+
+		/**
+		 * @brief      Adds one frame to the transmit queue, superseding a queued setpoint for the same node
+		 *
+		 * @param      frame  - The framed message
+		 * @param      len    - Length of the frame
+		 */
+		void enqueueFrame(const uint8_t * frame, uint16_t len);
+#endif
+
+#if VESC_LARGE_FRAME_ARENA > 0
+		/**
+		 * @brief      Borrows a slot of the shared arena for a large frame
+		 *
+		 * @param      length  - Length of the complete frame
+		 * @return     The slot, -1 if none is free or the frame does not fit
+		 */
+		int8_t borrowLargeFrame(uint32_t length);
+
+		/**
+		 * @brief      The memory of a borrowed slot
+		 *
+		 * @param      slot  - Slot returned by borrowLargeFrame()
+		 */
+		uint8_t * largeFrameSlot(int8_t slot);
+
+		/**
+		 * @brief      Verifies a received large frame and passes its payload to the subscribers
+		 *
+		 * @param      frame       - The complete frame
+		 * @param      lenPayload  - Length of the payload
+		 */
+		void processLargeFrame(uint8_t * frame, uint16_t lenPayload);
+#endif
+
+		/**
+		 * @brief      Returns a slot to the shared arena, does nothing for -1
+		 *
+		 * @param      slot  - Slot returned by borrowLargeFrame()
+		 */
+		void releaseLargeFrame(int8_t slot);
+
+		/**
+		 * @brief      Sends one or more framed messages, directly or through the transmit queue
+		 *
+		 * @param      frames  - The framed messages, back to back
+		 * @param      length  - Total length
+		 */
+		void writeFrames(uint8_t * frames, int length);
+
+		/** Variables to hold the last request sent, to match it with its reply */
+		uint8_t requestPacketId = 0;
+		uint8_t requestCanId = 0;
+
+#if VESC_RTT_ENTRIES > 0
+		/** Variables to hold the adaptive timeout state */
+		rttEntry rttTable[VESC_RTT_ENTRIES];
+		uint8_t rttNext = 0;
+		uint32_t timeoutFloor = 0;
+		uint32_t timeoutCeiling = 0;
+		uint32_t requestMicros = 0;
+
+		/**
+		 * @brief      Finds the round trip estimate of a request type
+		 *
+		 * @param      packetId  - The COMM_PACKET_ID of the request
+		 * @param      canId     - The CAN ID of the VESC
+		 * @param      create    - Take over the oldest slot if there is no entry yet
+		 * @return     The entry, NULL if not found and create is false
+		 */
+		rttEntry * findRtt(uint8_t packetId, uint8_t canId, bool create);
+#endif
+
+		/** Variable to hold the clock used for timeouts */
+		unsigned long (*timeSource)(void) = millis;
+		unsigned long (*microsSource)(void) = micros;
+
 		/**
 		 * @brief      Packs the payload and sends it over Serial
 		 *
@@ -199,6 +768,17 @@ class VescUart
 		 */
 		int packSendPayload(uint8_t * payload, int lenPay);
 
+		/**
+		 * @brief      Packs the payload into a UART frame without sending it
+		 *
+		 * @param      payload      - The payload as a unit8_t Array with length of int lenPayload
+		 * @param      lenPay       - Length of payload
+		 * @param      messageSend  - Destination for the frame
+		 * @param      lenMessage   - Size of the destination
+		 * @return     The number of bytes in the frame, 0 if it does not fit
+		 */
+		int packPayload(uint8_t * payload, int lenPay, uint8_t * messageSend, int lenMessage);
+
 		/**
 		 * @brief      Receives the message over Serial
 		 *
@@ -221,9 +801,10 @@ class VescUart
 		 * @brief      Extracts the data from the received payload
 		 *
 		 * @param      message  - The payload to extract data from
+		 * @param      lenMes   - The length of the payload, nothing beyond it is read
 		 * @return     True if the process was a success
 		 */
-		bool processReadPacket(uint8_t * message);
+		bool processReadPacket(uint8_t * message, int lenMes);
 
 		/**
 		 * @brief      Help Function to print uint8_t array over Serial for Debug